@@ -0,0 +1,344 @@
+// Microbenchmarks for src/util and the per-message paths in server-list.
+//
+// Each benchmark is warmed up while working out how many iterations make
+// a run of about RUN_NSEC, then timed over RUNS runs. Reported per op:
+// min/median/max ns, allocations (glibc only) and median cycles (where
+// perf_event_open is allowed).
+//
+// server-list.c is included whole so its internals can be driven
+// directly; its logging goes to /dev/null while the benchmarks run.
+// The clients have no real sockets, so its close() is stubbed out to keep
+// a failing syscall out of the timings.
+#define _GNU_SOURCE
+#include <unistd.h>
+
+int bench_close(int fd) {
+    return 0;
+}
+
+#define main server_list_main
+#define close bench_close
+#include "net/server-list.c"
+#undef close
+#undef main
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define RUNS 11
+#define RUN_NSEC 50000000L
+#define LIST_LEN 1024
+#define NUM_LOOKUP_CLIENTS 1024
+#define LINES_PER_BATCH 64
+
+struct bench {
+    char *name;
+    void (*setup)(void);
+    void (*run)(long iters);
+    void (*teardown)(void);
+};
+
+long bench_allocs;
+
+#ifdef __GLIBC__
+// Count every allocation, including the ones inside libc like strdup
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    bench_allocs++;
+    return __libc_realloc(p, size);
+}
+#endif
+
+int cycles_fd = -1;
+
+void setup_cycles() {
+#ifdef __linux__
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+long read_cycles() {
+    long long count = 0;
+    if (cycles_fd < 0 || read(cycles_fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+long now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Fixtures shared by the benchmarks
+
+struct server bench_server;
+struct client *bench_client;
+struct list *bench_list;
+char bench_lines[LINES_PER_BATCH * 16];
+size_t bench_lines_len;
+char bench_partial[POOL_BUF_SIZE];
+size_t bench_partial_len;
+volatile long sink;
+
+void setup_server_fixture() {
+    memset(&bench_server, 0, sizeof(bench_server));
+    bench_server.mem_budget = DEFAULT_MEM_BUDGET;
+    bench_client = make_client(&bench_server);
+    bench_client->fd = -1;
+    bench_client->status = 1;
+    add_client_to_list(&bench_server.clients, bench_client);
+    client_borrow_buf(&bench_server, bench_client);
+}
+
+void teardown_server_fixture() {
+    struct list *clients;
+    for (clients = bench_server.clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        c->status = 0;
+    }
+    server_remove_dead_clients(&bench_server);
+    server_drain_pool(&bench_server);
+}
+
+// cons: allocate and free one cell
+
+void run_cons(long iters) {
+    for (long i = 0; i < iters; i++) {
+        struct list *l = cons(NULL, NULL);
+        sink = (long) l;
+        free(l);
+    }
+}
+
+// list_traverse: walk a LIST_LEN cell list
+
+void setup_list() {
+    bench_list = NULL;
+    for (long i = 0; i < LIST_LEN; i++) {
+        bench_list = cons((void *) i, bench_list);
+    }
+}
+
+void run_list_traverse(long iters) {
+    for (long i = 0; i < iters; i++) {
+        long sum = 0;
+        for (struct list *l = bench_list; l; l = l->next) {
+            sum += (long) l->car;
+        }
+        sink = sum;
+    }
+}
+
+void teardown_list() {
+    while (bench_list) {
+        struct list *next = bench_list->next;
+        free(bench_list);
+        bench_list = next;
+    }
+}
+
+// client_lookup: find a client by fd among NUM_LOOKUP_CLIENTS
+
+void setup_lookup() {
+    memset(&bench_server, 0, sizeof(bench_server));
+    bench_server.mem_budget = DEFAULT_MEM_BUDGET;
+    for (int fd = 0; fd < NUM_LOOKUP_CLIENTS; fd++) {
+        struct client *c = make_client(&bench_server);
+        c->fd = fd;
+        c->status = 1;
+        add_client_to_list(&bench_server.clients, c);
+    }
+}
+
+void run_client_lookup(long iters) {
+    for (long i = 0; i < iters; i++) {
+        int fd = i % NUM_LOOKUP_CLIENTS;
+        struct list *clients;
+        for (clients = bench_server.clients; clients; clients = clients->next) {
+            struct client *c = clients->car;
+            if (c->fd == fd) {
+                sink = (long) c;
+                break;
+            }
+        }
+    }
+}
+
+void teardown_lookup() {
+    struct list *clients;
+    for (clients = bench_server.clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        // keep close() away from real fds
+        c->fd = -1;
+        c->status = 0;
+    }
+    server_remove_dead_clients(&bench_server);
+}
+
+// line_framing: split a recv of LINES_PER_BATCH commands and reply to them
+
+void setup_framing() {
+    setup_server_fixture();
+    bench_lines_len = 0;
+    for (int i = 0; i < LINES_PER_BATCH; i++) {
+        memcpy(bench_lines + bench_lines_len, "PUB none x\n", 11);
+        bench_lines_len += 11;
+    }
+}
+
+void run_line_framing(long iters) {
+    struct client *c = bench_client;
+    for (long i = 0; i < iters; i++) {
+        memcpy(c->buf, bench_lines, bench_lines_len);
+        c->buf_fill = bench_lines_len;
+        server_process_client(&bench_server, c, c->buf, bench_lines_len);
+        client_clear_queue(&bench_server, c);
+    }
+}
+
+// buffer_compaction: one short command followed by a partial line that
+// has to be moved to the front of the buffer
+
+void setup_compaction() {
+    setup_server_fixture();
+    bench_partial_len = POOL_BUF_SIZE / 2;
+    memset(bench_partial, 'x', bench_partial_len);
+    memcpy(bench_partial, "PUB none x\n", 11);
+}
+
+void run_buffer_compaction(long iters) {
+    struct client *c = bench_client;
+    for (long i = 0; i < iters; i++) {
+        memcpy(c->buf, bench_partial, bench_partial_len);
+        c->buf_fill = bench_partial_len;
+        server_process_client(&bench_server, c, c->buf, bench_partial_len);
+        client_clear_queue(&bench_server, c);
+    }
+}
+
+// accept_remove_churn: a client connects and goes away again
+
+void setup_churn() {
+    memset(&bench_server, 0, sizeof(bench_server));
+    bench_server.mem_budget = DEFAULT_MEM_BUDGET;
+}
+
+void run_accept_remove_churn(long iters) {
+    for (long i = 0; i < iters; i++) {
+        struct client *c = make_client(&bench_server);
+        c->fd = -1;
+        add_client_to_list(&bench_server.clients, c);
+        server_remove_dead_clients(&bench_server);
+    }
+}
+
+struct bench benches[] = {
+    { "cons", NULL, run_cons, NULL },
+    { "list_traverse_1024", setup_list, run_list_traverse, teardown_list },
+    { "client_lookup_1024", setup_lookup, run_client_lookup, teardown_lookup },
+    { "line_framing_64", setup_framing, run_line_framing, teardown_server_fixture },
+    { "buffer_compaction_4k", setup_compaction, run_buffer_compaction, teardown_server_fixture },
+    { "accept_remove_churn", setup_churn, run_accept_remove_churn, NULL },
+};
+
+int compare_double(const void *a, const void *b) {
+    double x = *(double *) a;
+    double y = *(double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(long *) a;
+    long y = *(long *) b;
+    return x < y ? -1 : x > y;
+}
+
+void run_bench(FILE *out, struct bench *b) {
+    double nsec[RUNS];
+    long cycles[RUNS];
+    long allocs = 0;
+    long iters = 1;
+    long elapsed = 0;
+
+    if (b->setup) b->setup();
+    // Warm up, doubling until a run takes long enough to time
+    while (elapsed < RUN_NSEC / 10) {
+        iters *= 2;
+        long start = now_nsec();
+        b->run(iters);
+        elapsed = now_nsec() - start;
+    }
+    iters = iters * (RUN_NSEC / (double) elapsed);
+    if (iters < 1) iters = 1;
+
+    for (int r = 0; r < RUNS; r++) {
+        long start_allocs = bench_allocs;
+        long start_cycles = read_cycles();
+        long start = now_nsec();
+        b->run(iters);
+        long end = now_nsec();
+        long end_cycles = read_cycles();
+        allocs += bench_allocs - start_allocs;
+        nsec[r] = (end - start) / (double) iters;
+        cycles[r] = start_cycles < 0 ? -1 : (end_cycles - start_cycles) / iters;
+    }
+    if (b->teardown) b->teardown();
+
+    qsort(nsec, RUNS, sizeof(nsec[0]), compare_double);
+    qsort(cycles, RUNS, sizeof(cycles[0]), compare_long);
+    fprintf(out, "%-24s %10ld %10.1f %10.1f %10.1f %10.2f", b->name, iters,
+            nsec[0], nsec[RUNS / 2], nsec[RUNS - 1], allocs / (double) (iters * RUNS));
+    if (cycles[RUNS / 2] >= 0) {
+        fprintf(out, " %10ld\n", cycles[RUNS / 2]);
+    } else {
+        fprintf(out, " %10s\n", "-");
+    }
+    fflush(out);
+}
+
+int main(int argc, char **argv) {
+    // results go to the real stdout, the server's logging doesn't
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        perror("microbench");
+        return 1;
+    }
+    setup_cycles();
+    fprintf(out, "%-24s %10s %10s %10s %10s %10s %10s\n", "benchmark", "iters/run",
+            "min ns/op", "med ns/op", "max ns/op", "allocs/op", "cycles/op");
+    for (unsigned i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        // run just the named benchmarks if any are given
+        int wanted = argc < 2;
+        for (int a = 1; a < argc; a++) {
+            wanted |= !strcmp(argv[a], benches[i].name);
+        }
+        if (wanted) {
+            run_bench(out, &benches[i]);
+        }
+    }
+    return 0;
+}
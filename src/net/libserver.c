@@ -0,0 +1,360 @@
+// Server core for embedding, see libserver.h.
+// Uses epoll on Linux and kqueue elsewhere, so the whole server can be
+// watched through one fd.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+#include "net/libserver.h"
+#include "util/list.h"
+
+#define MAX_CLIENTS 128
+// most events handled by one libserver_run_once
+#define MAX_EVENTS 64
+#define DEFAULT_MAX_OUT (256 * 1024)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct libserver {
+    // socket to listen for connections on
+    int fd;
+    // epoll or kqueue fd, readable when something is ready
+    int pollfd;
+    // sockets for connected clients
+    struct list *clients;
+    struct libserver_callbacks callbacks;
+    void *data;
+    // most output queued for one client, and what happens past it
+    size_t max_out;
+    enum libserver_slow_policy slow_policy;
+
+    // receive buffer shared by all clients
+    char msg[BUFSIZ];
+};
+
+// One ready fd, whichever backend reported it
+struct libserver_event {
+    // the client, or NULL for the listening socket
+    struct libserver_client *client;
+    int readable;
+    int writable;
+};
+
+static int poller_create();
+static int poller_set(struct libserver *server, int fd, void *ptr, int want_write, int add);
+static int poller_wait(struct libserver *server, struct libserver_event *events, int max);
+static int setup_server(struct libserver *server, char *port);
+static void server_accept(struct libserver *server);
+static void server_client_recv(struct libserver *server, struct libserver_client *client);
+static void server_client_flush(struct libserver *server, struct libserver_client *client);
+static int server_remove_dead_clients(struct libserver *server);
+
+
+static int poller_create() {
+#ifdef __linux__
+    return epoll_create1(EPOLL_CLOEXEC);
+#else
+    return kqueue();
+#endif
+}
+
+// Watches fd for reading, and for writing as well if want_write
+static int poller_set(struct libserver *server, int fd, void *ptr, int want_write, int add) {
+#ifdef __linux__
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    return epoll_ctl(server->pollfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#else
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD, 0, 0, ptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | (want_write ? EV_ENABLE : EV_DISABLE), 0, 0, ptr);
+    return kevent(server->pollfd, ev, 2, NULL, 0, NULL);
+#endif
+}
+
+// Collects whatever is ready without waiting
+static int poller_wait(struct libserver *server, struct libserver_event *events, int max) {
+    int n;
+    int i;
+#ifdef __linux__
+    struct epoll_event evs[MAX_EVENTS];
+    n = epoll_wait(server->pollfd, evs, max, 0);
+    for (i = 0; i < n; i++) {
+        events[i].client = evs[i].data.ptr;
+        events[i].readable = (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+        events[i].writable = (evs[i].events & EPOLLOUT) != 0;
+    }
+#else
+    struct kevent evs[MAX_EVENTS];
+    struct timespec zero = {0};
+    n = kevent(server->pollfd, NULL, 0, evs, max, &zero);
+    for (i = 0; i < n; i++) {
+        events[i].client = evs[i].udata;
+        events[i].readable = evs[i].filter == EVFILT_READ;
+        events[i].writable = evs[i].filter == EVFILT_WRITE;
+    }
+#endif
+    return n;
+}
+
+// Creates the non-blocking socket for accepting new connections.
+// Returns -1 on failure.
+static int setup_server(struct libserver *server, char *port) {
+    struct addrinfo hints = { 0 };
+    struct addrinfo *res = NULL;
+    int yes = 1;
+    int ret = -1;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(NULL, port, &hints, &res)) {
+        perror("server_setup getaddrinfo");
+        return -1;
+    }
+    server->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (server->fd < 0) {
+        perror("setup_servsock socket");
+    } else if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))) {
+        perror("server_setup setsockopt REUSEADDR");
+    } else if (bind(server->fd, res->ai_addr, res->ai_addrlen)) {
+        perror("setup_servsock bind");
+    } else if (listen(server->fd, MAX_CLIENTS)) {
+        perror("listen");
+    } else {
+        fcntl(server->fd, F_SETFL, fcntl(server->fd, F_GETFL) | O_NONBLOCK);
+        ret = 0;
+    }
+    freeaddrinfo(res);
+    return ret;
+}
+
+struct libserver *libserver_open(char *port, struct libserver_callbacks *callbacks, void *data) {
+    struct libserver *server = calloc(1, sizeof(struct libserver));
+    if (!server) return NULL;
+    server->fd = -1;
+    server->max_out = DEFAULT_MAX_OUT;
+    server->callbacks = *callbacks;
+    server->data = data;
+    server->pollfd = poller_create();
+    if (server->pollfd < 0) {
+        perror("libserver_open poller_create");
+    } else if (!setup_server(server, port) && !poller_set(server, server->fd, NULL, 0, 1)) {
+        return server;
+    }
+    libserver_free(server);
+    return NULL;
+}
+
+void *libserver_data(struct libserver *server) {
+    return server->data;
+}
+
+int libserver_pollfd(struct libserver *server) {
+    return server->pollfd;
+}
+
+void libserver_set_max_output(struct libserver *server, size_t bytes, enum libserver_slow_policy policy) {
+    server->max_out = bytes;
+    server->slow_policy = policy;
+}
+
+int libserver_run_once(struct libserver *server) {
+    struct libserver_event events[MAX_EVENTS];
+    int n = poller_wait(server, events, MAX_EVENTS);
+    int i;
+    if (n < 0) {
+        if (errno != EINTR) {
+            perror("libserver_run_once");
+        }
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        struct libserver_client *c = events[i].client;
+        if (!c) {
+            server_accept(server);
+            continue;
+        }
+        if (c->status && events[i].writable) {
+            server_client_flush(server, c);
+        }
+        if (c->status && events[i].readable) {
+            server_client_recv(server, c);
+        }
+    }
+    // Freed only now, later events in the batch may point at them
+    server_remove_dead_clients(server);
+    return n;
+}
+
+static void server_accept(struct libserver *server) {
+    for (;;) {
+        struct libserver_client *c = calloc(1, sizeof(struct libserver_client));
+        if (!c) {
+            // the connection waits in the backlog for the next round
+            perror("server_accept calloc");
+            return;
+        }
+        socklen_t socklen = sizeof(c->sockaddr);
+        c->fd = accept(server->fd, (struct sockaddr *) &c->sockaddr, &socklen);
+        if (c->fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("server_accept");
+            }
+            free(c);
+            return;
+        }
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        if (poller_set(server, c->fd, c, 0, 1)) {
+            perror("server_accept poller_set");
+            close(c->fd);
+            free(c);
+            continue;
+        }
+        c->status = 1;
+        server->clients = cons(c, server->clients);
+        if (server->callbacks.on_connect) {
+            server->callbacks.on_connect(server, c);
+        }
+    }
+}
+
+static void server_client_recv(struct libserver *server, struct libserver_client *c) {
+    ssize_t recvd = recv(c->fd, server->msg, sizeof(server->msg), 0);
+    if (recvd > 0) {
+        if (server->callbacks.on_data) {
+            server->callbacks.on_data(server, c, server->msg, recvd);
+        }
+    } else if (recvd == 0) {
+        c->status = 0;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recv");
+        c->status = 0;
+    }
+}
+
+int libserver_send(struct libserver *server, struct libserver_client *c, char *data, size_t len) {
+    ssize_t sent = 0;
+    if (!c->status) return -1;
+    if (!c->out_fill) {
+        sent = send(c->fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("send");
+                c->status = 0;
+                return -1;
+            }
+            sent = 0;
+        }
+    }
+    if ((size_t) sent == len) return 0;
+
+    // Over the limit, drop it if none of it went out, since that leaves
+    // the stream intact. Otherwise, or if the policy says so, close.
+    if (c->out_fill + len - sent > server->max_out) {
+        if (server->slow_policy == LIBSERVER_SLOW_DROP && sent == 0) {
+            return -1;
+        }
+        printf("libserver: fd %d not reading its output, closing\n", c->fd);
+        c->status = 0;
+        return -1;
+    }
+
+    // Queue the rest until the socket is writable again
+    len -= sent;
+    if (c->out_fill + len > c->out_size) {
+        size_t size = c->out_size ? c->out_size : BUFSIZ;
+        while (size < c->out_fill + len) {
+            size *= 2;
+        }
+        char *out = realloc(c->out, size);
+        if (!out) {
+            perror("libserver_send realloc");
+            c->status = 0;
+            return -1;
+        }
+        c->out = out;
+        c->out_size = size;
+    }
+    memcpy(c->out + c->out_fill, data + sent, len);
+    if (!c->out_fill) {
+        poller_set(server, c->fd, c, 1, 0);
+    }
+    c->out_fill += len;
+    return 0;
+}
+
+static void server_client_flush(struct libserver *server, struct libserver_client *c) {
+    ssize_t sent = send(c->fd, c->out, c->out_fill, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("send");
+            c->status = 0;
+        }
+        return;
+    }
+    c->out_fill -= sent;
+    memmove(c->out, c->out + sent, c->out_fill);
+    if (!c->out_fill) {
+        poller_set(server, c->fd, c, 0, 0);
+    }
+}
+
+void libserver_close_client(struct libserver *server, struct libserver_client *client) {
+    client->status = 0;
+}
+
+static int server_remove_dead_clients(struct libserver *server) {
+    int num_removed = 0;
+    struct libserver_client *tmpclient;
+    struct list **holder = &server->clients;
+    while (*holder) {
+        struct list *cell = *holder;
+        tmpclient = cell->car;
+        if (!tmpclient->status) {
+            if (server->callbacks.on_close) {
+                server->callbacks.on_close(server, tmpclient);
+            }
+            // closing it takes it out of the poller too
+            close(tmpclient->fd);
+            *holder = cell->next;
+            free(tmpclient->out);
+            free(tmpclient);
+            free(cell);
+            num_removed++;
+        } else {
+            holder = &cell->next;
+        }
+    }
+    return num_removed;
+}
+
+void libserver_free(struct libserver *server) {
+    struct list *clients;
+    for (clients = server->clients; clients; clients = clients->next) {
+        struct libserver_client *c = clients->car;
+        c->status = 0;
+    }
+    server_remove_dead_clients(server);
+    if (server->fd >= 0) {
+        close(server->fd);
+    }
+    if (server->pollfd >= 0) {
+        close(server->pollfd);
+    }
+    free(server);
+}
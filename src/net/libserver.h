@@ -0,0 +1,55 @@
+#pragma once
+// Server core that can be embedded in another program's event loop.
+//
+// Watch libserver_pollfd() for reading with whatever the program already
+// uses (select, poll, epoll, kqueue...). When it's readable, call
+// libserver_run_once(), which handles whatever is ready without blocking
+// and calls back into the program.
+#include <netinet/in.h>
+#include <stddef.h>
+
+struct libserver;
+
+struct libserver_client {
+    int fd;
+    int status;
+    struct sockaddr_in sockaddr;
+    // output the socket hasn't taken yet
+    char *out;
+    size_t out_size;
+    size_t out_fill;
+    // for the program's own use
+    void *data;
+};
+
+struct libserver_callbacks {
+    void (*on_connect)(struct libserver *server, struct libserver_client *client);
+    // data is only valid until the callback returns
+    void (*on_data)(struct libserver *server, struct libserver_client *client, char *data, size_t len);
+    void (*on_close)(struct libserver *server, struct libserver_client *client);
+};
+
+// What libserver_send does when a client's queued output would go over
+// the limit
+enum libserver_slow_policy {
+    LIBSERVER_SLOW_CLOSE,   // close the client (the default)
+    LIBSERVER_SLOW_DROP,    // drop what's being sent
+};
+
+// Returns NULL if the port can't be listened on
+struct libserver *libserver_open(char *port, struct libserver_callbacks *callbacks, void *data);
+// The data passed to libserver_open
+void *libserver_data(struct libserver *server);
+int libserver_pollfd(struct libserver *server);
+// Limits the output queued for each client, 256 KiB unless set
+void libserver_set_max_output(struct libserver *server, size_t bytes, enum libserver_slow_policy policy);
+// Handles everything that's ready without blocking. Returns the number of
+// events handled.
+int libserver_run_once(struct libserver *server);
+// Sends what the socket takes now and queues the rest. Returns -1 if the
+// client is gone or the data was dropped.
+int libserver_send(struct libserver *server, struct libserver_client *client, char *data, size_t len);
+// Closes the client after the current round of events, calling on_close
+void libserver_close_client(struct libserver *server, struct libserver_client *client);
+// Closes every client and the server itself
+void libserver_free(struct libserver *server);
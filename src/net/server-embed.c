@@ -0,0 +1,56 @@
+// Example of embedding libserver in a program that already has its own
+// event loop, here a poll() on stdin.
+// Echoes back whatever clients send. Control-D in the console exits.
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "net/libserver.h"
+
+void on_connect(struct libserver *server, struct libserver_client *client) {
+    printf("connected fd %d\n", client->fd);
+}
+
+void on_data(struct libserver *server, struct libserver_client *client, char *data, size_t len) {
+    printf("fd %d sent %zu bytes\n", client->fd, len);
+    libserver_send(server, client, data, len);
+}
+
+void on_close(struct libserver *server, struct libserver_client *client) {
+    printf("closed fd %d\n", client->fd);
+}
+
+int main(int argc, char **argv) {
+    struct libserver_callbacks callbacks = { on_connect, on_data, on_close };
+    char *port = "19567";
+    char line[BUFSIZ];
+    int running = 1;
+    if (argc > 1) {
+        port = argv[1];
+    }
+    struct libserver *server = libserver_open(port, &callbacks, NULL);
+    if (!server) {
+        return 1;
+    }
+    // The program's own loop, the server is just one more fd in it
+    while (running) {
+        struct pollfd fds[2] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { libserver_pollfd(server), POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (read(STDIN_FILENO, line, sizeof(line)) <= 0) {
+                // Control-D pressed
+                running = 0;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            libserver_run_once(server);
+        }
+    }
+    libserver_free(server);
+    return 0;
+}
@@ -1,23 +1,112 @@
-// Server program that stores its clients in a list, each with its
-// own input buffer
+// Server program that stores its clients in a list. Clients borrow an
+// input buffer from a shared pool only while they have data in it
+//
+// To spread over cores, run one per CPU with -c; they share the port and,
+// from Linux 6.1, the kernel hands each connection to the one on the CPU
+// that received it. Older kernels spread connections by hash instead.
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include "util/list.h"
 
 #define MAX_CLIENTS 128
+// input buffers shrink back to this size when memory is tight
+#define MIN_BUF_SIZE 256
+// a line longer than this gets the client disconnected
+#define MAX_BUF_SIZE (64 * 1024)
+#define DEFAULT_MEM_BUDGET (64 * 1024 * 1024)
+// size of the receive buffers lent out from the shared pool
+#define POOL_BUF_SIZE BUFSIZ
+// free buffers beyond this go back to the allocator
+#define POOL_MAX_FREE 64
+// output queued beyond this makes a client a slow consumer
+#define MAX_OUT_BYTES (256 * 1024)
+// most queued messages handed to a single writev
+#define SEND_IOV_MAX 64
+#define MAX_CHANNEL_NAME 64
+// binary frames longer than this get the client disconnected
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+// most bytes framing adds to a payload, a varint header or a newline
+#define MAX_FRAME_OVERHEAD 5
+// smallest allocation for a client's batch of replies
+#define MIN_REPLY_SIZE 256
+
+// how long select blocks when there's nothing to do
+#define IDLE_TIMEOUT_USEC 1000000
+
+// How the stream from a client is split into commands
+enum framing {
+    FRAMING_TEXT,     // newline terminated lines
+    FRAMING_BINARY,   // varint length followed by that many bytes
+};
+
+// What to do with a subscriber whose output queue is full
+enum slow_policy {
+    SLOW_DROP,    // drop new messages until the queue drains
+    SLOW_CLOSE,   // disconnect the client
+};
+
+// A message shared by every output queue it's in, freed with the last ref
+struct message {
+    unsigned refs;
+    size_t len;
+    char data[];
+};
+
+// A named channel and its subscribers, as struct subscription
+struct channel {
+    char *name;
+    struct list *subscribers;
+    // the subscriber the channel's memory is charged to
+    struct client *owner;
+};
+
+struct subscription {
+    struct client *client;
+    enum slow_policy policy;
+};
 
 struct client {
     int fd;
     int status;
     struct sockaddr_in sockaddr;
+    // receive buffer, only held while there's data in it
     char *buf;
     unsigned buf_size;
     unsigned buf_fill;
+    // a binary frame too big for buf, received straight into its own
+    // allocation
+    char *frame;
+    size_t frame_len;
+    size_t frame_fill;
+    // ring of messages waiting to be sent
+    struct message **out;
+    unsigned out_cap;
+    unsigned out_head;
+    unsigned out_count;
+    // bytes of the first message already sent
+    size_t out_off;
+    // bytes left to send across the queue
+    size_t out_bytes;
+    // set when something was queued since the last send, so we try to send
+    // without waiting for select to say the socket is writable
+    int out_fresh;
+    // replies to this batch of commands, queued as one message when the
+    // batch is done or before anything else is queued
+    struct message *reply;
+    size_t reply_cap;
+    // bytes currently allocated on behalf of this client
+    size_t mem;
 };
 
 struct server {
@@ -26,25 +115,123 @@ struct server {
     int fd;
     // sockets for connected clients
     struct list *clients;
+    // pub/sub channels with at least one subscriber
+    struct list *channels;
+    enum framing framing;
+    // CPU the loop is pinned to and takes connections for, -1 if not pinned
+    int cpu;
+
+    // latency mode: most time to poll without blocking before select
+    // sleeps, 0 to always sleep
+    long spin_budget_usec;
+    // current polling window, adapted from the time between events
+    long spin_usec;
+    // moving average of the time between events
+    long event_gap_usec;
+    long last_event_usec;
+    // SO_BUSY_POLL for client sockets, 0 to leave it alone. Raising it
+    // needs CAP_NET_ADMIN, and select only busy polls when the
+    // net.core.busy_poll sysctl is set too.
+    int busy_poll_usec;
 
     // buffer
     char msg[BUFSIZ];
     // fill of the buffer
     long num_msg;
+
+    // free receive buffers, each linked to the next through its first bytes
+    char *pool;
+    unsigned pool_free;
+
+    // bytes allocated on behalf of all clients, including the pool
+    size_t mem_used;
+    // once mem_used goes over this, idle buffers are released and the
+    // largest consumers are disconnected
+    size_t mem_budget;
 };
 
+int setup_affinity(struct server *server, char *cpus);
 void setup_server(struct server *server, char *port);
+void setup_steering(struct server *server);
 void server_process_fds(struct server *server, int do_stdin);
 
-int setup_select(fd_set *fdset, int servsock, struct list *clients);
+int setup_select(fd_set *fdset, fd_set *writefds, int servsock, struct list *clients);
+long now_usec();
+void server_adapt_spin(struct server *server);
 void server_console(struct server *server, fd_set *readfds);
 void server_client_recv(struct server *server, fd_set *readfds);
+void server_client_send(struct server *server, fd_set *writefds);
 int server_remove_dead_clients(struct server *server);
+void server_enforce_budget(struct server *server);
+size_t client_sole_mem(struct client *c);
+void client_flush_reply(struct server *server, struct client *c);
 void server_accept(struct server *server, fd_set *readfds);
 int accept_connection(int servsock, struct client *c);
 ssize_t recv_all(int fd, void *buf, size_t num_bytes, int flags);
 
 
+// Pins the process to a comma separated list of CPUs. Connections are
+// steered to the first one. Returns -1 if the list doesn't parse.
+int setup_affinity(struct server *server, char *cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    char *tok;
+    CPU_ZERO(&set);
+    server->cpu = -1;
+    while ((tok = strsep(&cpus, ","))) {
+        char *end;
+        long cpu = strtol(tok, &end, 10);
+        if (end == tok || *end || cpu < 0 || cpu >= CPU_SETSIZE) {
+            fprintf(stderr, "setup_affinity: bad cpu \"%s\", expected cpu[,cpu...]\n", tok);
+            return -1;
+        }
+        if (server->cpu < 0) {
+            server->cpu = cpu;
+        }
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        perror("setup_affinity sched_setaffinity");
+        return -1;
+    }
+    printf("pinned, taking connections for cpu %d\n", server->cpu);
+    return 0;
+#else
+    fprintf(stderr, "setup_affinity: not supported on this platform\n");
+    return -1;
+#endif
+}
+
+// Lets other processes listen on the same port and asks the kernel to
+// give us the connections whose packets arrive on our CPU. Before Linux
+// 6.1 the reuseport hash ignores SO_INCOMING_CPU, so there it only shares
+// the port.
+void setup_steering(struct server *server) {
+    int yes = 1;
+    if (setsockopt(server->fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+        perror("setup_steering setsockopt REUSEPORT");
+    }
+#ifdef SO_INCOMING_CPU
+    if (setsockopt(server->fd, SOL_SOCKET, SO_INCOMING_CPU, &server->cpu, sizeof(server->cpu))) {
+        perror("setup_steering setsockopt INCOMING_CPU");
+    }
+#endif
+}
+
+// Fills the buffer pool up front. Once pinned, the pages are first
+// touched here on our CPU, so they come from its local NUMA node.
+void server_prefill_pool(struct server *server) {
+    while (server->pool_free < POOL_MAX_FREE) {
+        char *buf = malloc(POOL_BUF_SIZE);
+        if (!buf) break;
+        memset(buf, 0, POOL_BUF_SIZE);
+        *(char **) buf = server->pool;
+        server->pool = buf;
+        server->pool_free++;
+        server->mem_used += POOL_BUF_SIZE;
+    }
+}
+
 // Creates the socket for accepting new connections
 void setup_server(struct server *server, char *port) {
     struct addrinfo hints = { 0 };
@@ -69,6 +256,9 @@ void setup_server(struct server *server, char *port) {
             perror("server_setup setsockopt REUSEADDR");
             server->running = 0;
         } else {
+            if (server->cpu >= 0) {
+                setup_steering(server);
+            }
             printf("bind %s\n", port);
             if (bind(server->fd, res->ai_addr, res->ai_addrlen)) {
                 perror("setup_servsock bind");
@@ -88,22 +278,43 @@ void setup_server(struct server *server, char *port) {
 
 // Checks the connected sockets and optionally stdin.
 // Call this in a loop
+// In latency mode, polls without blocking for up to spin_usec before
+// letting select sleep.
 void server_process_fds(struct server *server, int do_stdin) {
     if (!server->running) return;
 
+    fd_set readset;
+    fd_set writeset;
     fd_set readfds;
-    int ready;
+    fd_set writefds;
+    int ready = 0;
     struct timeval tv = {0};
+    long start = now_usec();
 
-    int maxfd = setup_select(&readfds, server->fd, server->clients);
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
-    ready = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+    int maxfd = setup_select(&readset, &writeset, server->fd, server->clients);
+    while (server->spin_usec > 0) {
+        readfds = readset;
+        writefds = writeset;
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        ready = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
+        if (ready != 0 || now_usec() - start >= server->spin_usec) break;
+    }
+    if (ready == 0) {
+        readfds = readset;
+        writefds = writeset;
+        tv.tv_sec = IDLE_TIMEOUT_USEC / 1000000;
+        tv.tv_usec = IDLE_TIMEOUT_USEC % 1000000;
+        ready = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
+    }
     if (ready > 0) {
+        server_adapt_spin(server);
         if (do_stdin) {
             server_console(server, &readfds);
         }
         server_client_recv(server, &readfds);
+        server_client_send(server, &writefds);
+        server_enforce_budget(server);
         server_remove_dead_clients(server);
         server_accept(server, &readfds);
     } else if (ready < 0) {
@@ -111,17 +322,47 @@ void server_process_fds(struct server *server, int do_stdin) {
     }
 }
 
-int setup_select(fd_set *fdset, int servsock, struct list *clients) {
+long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Spins for about twice the average time between events, as long as
+// that's within the budget. When events are further apart than the
+// budget, spinning would just burn the CPU, so we sleep straight away.
+void server_adapt_spin(struct server *server) {
+    long now = now_usec();
+    if (!server->spin_budget_usec) return;
+    if (server->last_event_usec) {
+        long gap = now - server->last_event_usec;
+        server->event_gap_usec += (gap - server->event_gap_usec) / 8;
+    }
+    server->last_event_usec = now;
+    if (server->event_gap_usec >= server->spin_budget_usec) {
+        server->spin_usec = 0;
+    } else if (server->event_gap_usec * 2 < server->spin_budget_usec) {
+        server->spin_usec = server->event_gap_usec * 2;
+    } else {
+        server->spin_usec = server->spin_budget_usec;
+    }
+}
+
+int setup_select(fd_set *fdset, fd_set *writefds, int servsock, struct list *clients) {
     int maxfd = servsock;
     int i;
 
     FD_ZERO(fdset);
+    FD_ZERO(writefds);
     FD_SET(servsock, fdset);
     FD_SET(STDIN_FILENO, fdset);
     while (clients) {
         struct client *c = clients->car;
         int fd = c->fd;
         FD_SET(fd, fdset);
+        if (c->out_count) {
+            FD_SET(fd, writefds);
+        }
         if (fd > maxfd) {
             maxfd = fd;
         }
@@ -146,52 +387,698 @@ void server_console(struct server *server, fd_set *readfds) {
     }
 }
 
+// Allocation helpers that charge the memory to a client and the server
+void *client_alloc(struct server *server, struct client *c, size_t size) {
+    void *p = calloc(1, size);
+    if (p) {
+        c->mem += size;
+        server->mem_used += size;
+    }
+    return p;
+}
+
+void *client_realloc(struct server *server, struct client *c, void *p, size_t oldsize, size_t size) {
+    void *newp = realloc(p, size);
+    if (newp) {
+        c->mem += size - oldsize;
+        server->mem_used += size - oldsize;
+    }
+    return newp;
+}
+
+void client_free(struct server *server, struct client *c, void *p, size_t size) {
+    if (p) {
+        free(p);
+        c->mem -= size;
+        server->mem_used -= size;
+    }
+}
+
+// Resizes the input buffer, keeping whatever is buffered.
+// Resizing to 0 releases the buffer entirely.
+int client_resize_buf(struct server *server, struct client *c, unsigned size) {
+    if (size == 0) {
+        client_free(server, c, c->buf, c->buf_size);
+        c->buf = NULL;
+    } else {
+        char *buf = client_realloc(server, c, c->buf, c->buf_size, size);
+        if (!buf) {
+            return -1;
+        }
+        c->buf = buf;
+    }
+    c->buf_size = size;
+    return 0;
+}
+
+// Lends a receive buffer from the pool to a client that has data to read
+int client_borrow_buf(struct server *server, struct client *c) {
+    char *buf = server->pool;
+    if (buf) {
+        // the pool's charge moves over to the client
+        server->pool = *(char **) buf;
+        server->pool_free--;
+        c->mem += POOL_BUF_SIZE;
+    } else {
+        buf = client_alloc(server, c, POOL_BUF_SIZE);
+        if (!buf) {
+            return -1;
+        }
+    }
+    c->buf = buf;
+    c->buf_size = POOL_BUF_SIZE;
+    c->buf_fill = 0;
+    return 0;
+}
+
+// Gives the receive buffer back unless a partial line is still in it
+void client_return_buf(struct server *server, struct client *c) {
+    if (!c->buf || c->buf_fill) return;
+    if (c->buf_size == POOL_BUF_SIZE && server->pool_free < POOL_MAX_FREE) {
+        *(char **) c->buf = server->pool;
+        server->pool = c->buf;
+        server->pool_free++;
+        c->mem -= POOL_BUF_SIZE;
+        c->buf = NULL;
+        c->buf_size = 0;
+    } else {
+        client_resize_buf(server, c, 0);
+    }
+}
+
+void server_drain_pool(struct server *server) {
+    while (server->pool) {
+        char *buf = server->pool;
+        server->pool = *(char **) buf;
+        free(buf);
+        server->mem_used -= POOL_BUF_SIZE;
+    }
+    server->pool_free = 0;
+}
+
+// Decodes an unsigned LEB128 varint. Returns how many bytes it took, 0 if
+// it isn't all there yet, or -1 if it's too long to be a frame length.
+int decode_varint(char *p, size_t avail, size_t *value) {
+    size_t v = 0;
+    for (int n = 0; n < 5; n++) {
+        if (n == avail) return 0;
+        v |= (size_t) (p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            *value = v;
+            return n + 1;
+        }
+    }
+    return -1;
+}
+
+int encode_varint(char *p, size_t value) {
+    int n = 0;
+    while (value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+// Writes head followed by data to dst as one frame in the server's
+// framing, which needs up to MAX_FRAME_OVERHEAD extra bytes. Returns the
+// number of bytes written.
+size_t frame_parts(struct server *server, char *dst, char *head, size_t headlen, char *data, size_t len) {
+    size_t n = 0;
+    if (server->framing == FRAMING_BINARY) {
+        n = encode_varint(dst, headlen + len);
+    }
+    memcpy(dst + n, head, headlen);
+    n += headlen;
+    memcpy(dst + n, data, len);
+    n += len;
+    if (server->framing == FRAMING_TEXT) {
+        dst[n++] = '\n';
+    }
+    return n;
+}
+
+size_t frame_payload(struct server *server, char *dst, char *data, size_t len) {
+    return frame_parts(server, dst, "", 0, data, len);
+}
+
+// Makes a message in the server's framing for delivering the payload
+// published on the channel, "MSG <channel> <payload>"
+struct message *make_message(struct server *server, char *name, char *data, size_t len) {
+    char head[MAX_CHANNEL_NAME + 6];
+    size_t headlen = snprintf(head, sizeof(head), "MSG %s ", name);
+    struct message *msg = malloc(sizeof(struct message) + headlen + len + MAX_FRAME_OVERHEAD);
+    if (msg) {
+        msg->refs = 0;
+        msg->len = frame_parts(server, msg->data, head, headlen, data, len);
+        server->mem_used += sizeof(struct message) + msg->len;
+    }
+    return msg;
+}
+
+void message_unref(struct server *server, struct message *msg) {
+    if (--msg->refs == 0) {
+        server->mem_used -= sizeof(struct message) + msg->len;
+        free(msg);
+    }
+}
+
+// Queues a message to be sent to the client. Returns -1 if the client is
+// a slow consumer and the message was dropped.
+int client_enqueue(struct server *server, struct client *c, struct message *msg, enum slow_policy policy) {
+    if (!c->status) return -1;
+    // replies already made go first, so the client sees things in order
+    client_flush_reply(server, c);
+    // an empty queue takes anything, or a message bigger than the limit
+    // could never be delivered
+    if (c->out_bytes && c->out_bytes + msg->len > MAX_OUT_BYTES) {
+        if (policy == SLOW_CLOSE) {
+            printf("slow consumer, setting fd %d as dead\n", c->fd);
+            c->status = 0;
+        }
+        return -1;
+    }
+    if (c->out_count == c->out_cap) {
+        // Grow the ring, unwrapping it into the new array
+        unsigned cap = c->out_cap ? c->out_cap * 2 : 8;
+        struct message **out = client_alloc(server, c, cap * sizeof(*out));
+        if (!out) return -1;
+        for (unsigned k = 0; k < c->out_count; k++) {
+            out[k] = c->out[(c->out_head + k) % c->out_cap];
+        }
+        client_free(server, c, c->out, c->out_cap * sizeof(*out));
+        c->out = out;
+        c->out_cap = cap;
+        c->out_head = 0;
+    }
+    c->out[(c->out_head + c->out_count) % c->out_cap] = msg;
+    c->out_count++;
+    c->out_bytes += msg->len;
+    c->out_fresh = 1;
+    msg->refs++;
+    return 0;
+}
+
+// Adds a reply to the client's current batch
+void client_reply(struct server *server, struct client *c, char *data, size_t len) {
+    struct message *reply = c->reply;
+    size_t used = reply ? reply->len : 0;
+    if (!c->status) return;
+    if (used + len + MAX_FRAME_OVERHEAD > c->reply_cap) {
+        size_t cap = c->reply_cap ? c->reply_cap * 2 : MIN_REPLY_SIZE;
+        while (cap < used + len + MAX_FRAME_OVERHEAD) {
+            cap *= 2;
+        }
+        reply = realloc(reply, sizeof(struct message) + cap);
+        if (!reply) {
+            perror("client_reply");
+            return;
+        }
+        if (!c->reply) {
+            reply->refs = 0;
+            reply->len = 0;
+            server->mem_used += sizeof(struct message);
+        }
+        server->mem_used += cap - c->reply_cap;
+        c->reply = reply;
+        c->reply_cap = cap;
+    }
+    reply->len += frame_payload(server, reply->data + reply->len, data, len);
+}
+
+// Queues the batch of replies as a single message
+void client_flush_reply(struct server *server, struct client *c) {
+    struct message *msg = c->reply;
+    if (!msg) return;
+    c->reply = NULL;
+    // give back the unused tail so the message is charged like any other
+    struct message *shrunk = realloc(msg, sizeof(struct message) + msg->len);
+    if (shrunk) {
+        msg = shrunk;
+    }
+    server->mem_used -= c->reply_cap - msg->len;
+    c->reply_cap = 0;
+    msg->refs++;
+    // a client that doesn't read its replies doesn't get to keep sending
+    client_enqueue(server, c, msg, SLOW_CLOSE);
+    message_unref(server, msg);
+}
+
+// Drops everything still queued and the queue itself
+void client_clear_queue(struct server *server, struct client *c) {
+    if (c->reply) {
+        server->mem_used -= sizeof(struct message) + c->reply_cap;
+        free(c->reply);
+        c->reply = NULL;
+        c->reply_cap = 0;
+    }
+    while (c->out_count) {
+        message_unref(server, c->out[c->out_head]);
+        c->out_head = (c->out_head + 1) % c->out_cap;
+        c->out_count--;
+    }
+    client_free(server, c, c->out, c->out_cap * sizeof(*c->out));
+    c->out = NULL;
+    c->out_cap = 0;
+    c->out_off = 0;
+    c->out_bytes = 0;
+}
+
+struct channel *server_find_channel(struct server *server, char *name) {
+    struct list *channels;
+    for (channels = server->channels; channels; channels = channels->next) {
+        struct channel *ch = channels->car;
+        if (!strcmp(ch->name, name)) {
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+// What a channel takes besides its subscriptions, charged to its owner
+size_t channel_mem(struct channel *ch) {
+    return sizeof(struct channel) + strlen(ch->name) + 1 + sizeof(struct list);
+}
+
+// Frees a channel nobody is subscribed to and the list cell holding it
+void free_channel(struct server *server, struct list *chcell) {
+    struct channel *ch = chcell->car;
+    size_t mem = channel_mem(ch);
+    ch->owner->mem -= mem;
+    server->mem_used -= mem;
+    free(ch->name);
+    free(ch);
+    free(chcell);
+}
+
+// Returns -1 if we're out of memory
+int server_subscribe(struct server *server, struct client *c, char *name, enum slow_policy policy) {
+    struct channel *ch = server_find_channel(server, name);
+    struct list *subs;
+    if (!ch) {
+        // a new channel is charged to the client creating it
+        struct list *chcell = NULL;
+        ch = calloc(1, sizeof(struct channel));
+        if (ch) {
+            ch->name = strdup(name);
+            chcell = cons(ch, server->channels);
+        }
+        if (!chcell || !ch->name) {
+            perror("server_subscribe");
+            if (ch) free(ch->name);
+            free(ch);
+            free(chcell);
+            return -1;
+        }
+        ch->owner = c;
+        server->channels = chcell;
+        c->mem += channel_mem(ch);
+        server->mem_used += channel_mem(ch);
+    }
+    for (subs = ch->subscribers; subs; subs = subs->next) {
+        struct subscription *sub = subs->car;
+        if (sub->client == c) {
+            sub->policy = policy;
+            return 0;
+        }
+    }
+    struct subscription *sub = client_alloc(server, c, sizeof(struct subscription));
+    struct list *cell = sub ? cons(sub, ch->subscribers) : NULL;
+    if (!cell) {
+        perror("server_subscribe");
+        client_free(server, c, sub, sizeof(struct subscription));
+        if (!ch->subscribers) {
+            // the channel was just made for this client, at the head
+            struct list *chcell = server->channels;
+            server->channels = chcell->next;
+            free_channel(server, chcell);
+        }
+        return -1;
+    }
+    sub->client = c;
+    sub->policy = policy;
+    ch->subscribers = cell;
+    c->mem += sizeof(struct list);
+    server->mem_used += sizeof(struct list);
+    return 0;
+}
+
+// Removes the client from the channel, freeing the channel once nobody
+// is subscribed to it. A NULL name unsubscribes from every channel.
+void server_unsubscribe(struct server *server, struct client *c, char *name) {
+    struct list **chholder = &server->channels;
+    while (*chholder) {
+        struct list *chcell = *chholder;
+        struct channel *ch = chcell->car;
+        if (!name || !strcmp(ch->name, name)) {
+            struct list **holder = &ch->subscribers;
+            while (*holder) {
+                struct list *cell = *holder;
+                struct subscription *sub = cell->car;
+                if (sub->client == c) {
+                    *holder = cell->next;
+                    client_free(server, c, sub, sizeof(struct subscription));
+                    free(cell);
+                    c->mem -= sizeof(struct list);
+                    server->mem_used -= sizeof(struct list);
+                } else {
+                    holder = &cell->next;
+                }
+            }
+            if (ch->subscribers && ch->owner == c) {
+                // hand the charge to a client still subscribed
+                struct subscription *sub = ch->subscribers->car;
+                size_t mem = channel_mem(ch);
+                c->mem -= mem;
+                sub->client->mem += mem;
+                ch->owner = sub->client;
+            }
+        }
+        if (!ch->subscribers) {
+            *chholder = chcell->next;
+            free_channel(server, chcell);
+        } else {
+            chholder = &chcell->next;
+        }
+    }
+}
+
+// Sends the payload to every subscriber of the channel. The payload is
+// copied once and the same message is queued to each subscriber.
+void server_publish(struct server *server, char *name, char *data, size_t len) {
+    struct channel *ch = server_find_channel(server, name);
+    struct list *subs;
+    if (!ch) return;
+    struct message *msg = make_message(server, name, data, len);
+    if (!msg) {
+        perror("make_message");
+        return;
+    }
+    // hold a ref so a slow consumer dropping it can't free it early
+    msg->refs++;
+    for (subs = ch->subscribers; subs; subs = subs->next) {
+        struct subscription *sub = subs->car;
+        client_enqueue(server, sub->client, msg, sub->policy);
+    }
+    message_unref(server, msg);
+}
+
+int token_is(char *tok, size_t len, char *word) {
+    return len == strlen(word) && !memcmp(tok, word, len);
+}
+
+// Handles one command, a line or a binary frame. It points into the
+// receive buffer and isn't NUL terminated; PUB payloads may be binary.
+// Commands:
+//   SUB <channel> [drop|close]  subscribe, with what to do when we can't keep up
+//   UNSUB <channel>
+//   PUB <channel> <payload>
+// Subscribers get each payload published on the channel as
+// "MSG <channel> <payload>", framed like the commands.
+void server_handle_command(struct server *server, struct client *client, char *cmd, size_t len) {
+    char *end = cmd + len;
+    char *sp = memchr(cmd, ' ', len);
+    size_t verblen = sp ? sp - cmd : len;
+    char name[MAX_CHANNEL_NAME + 1];
+    char *rest = NULL;
+    size_t restlen = 0;
+
+    name[0] = '\0';
+    if (sp) {
+        char *namestart = sp + 1;
+        char *nameend = memchr(namestart, ' ', end - namestart);
+        if (!nameend) {
+            nameend = end;
+        } else {
+            rest = nameend + 1;
+            restlen = end - rest;
+        }
+        if (nameend - namestart <= MAX_CHANNEL_NAME) {
+            memcpy(name, namestart, nameend - namestart);
+            name[nameend - namestart] = '\0';
+        }
+    }
+
+    if (token_is(cmd, verblen, "SUB") && name[0]) {
+        enum slow_policy policy = rest && token_is(rest, restlen, "close") ? SLOW_CLOSE : SLOW_DROP;
+        if (server_subscribe(server, client, name, policy)) {
+            client_reply(server, client, "ERR out of memory", 17);
+        } else {
+            client_reply(server, client, "OK", 2);
+        }
+    } else if (token_is(cmd, verblen, "UNSUB") && name[0]) {
+        server_unsubscribe(server, client, name);
+        client_reply(server, client, "OK", 2);
+    } else if (token_is(cmd, verblen, "PUB") && name[0] && rest) {
+        server_publish(server, name, rest, restlen);
+        client_reply(server, client, "OK", 2);
+    } else {
+        if (server->framing == FRAMING_TEXT) {
+            printf("Full command received (%.*s)\n", (int) len, cmd);
+        } else {
+            printf("Full frame received (%zu bytes)\n", len);
+        }
+        client_reply(server, client, "ERR unknown command", 19);
+    }
+}
+
+// Handles every complete line in the buffer, then moves any partial line
+// to the front
+void server_process_lines(struct server *server, struct client *client, char *data, long datalen) {
+    char *start = client->buf;
+    char *end = client->buf + client->buf_fill;
+    char *nl;
+    // Only the new data can hold a newline we haven't seen
+    while ((nl = memchr(data, '\n', end - data))) {
+        size_t cmdlen = nl - start;
+        if (cmdlen && start[cmdlen - 1] == '\r') {
+            cmdlen--;
+        }
+        server_handle_command(server, client, start, cmdlen);
+        data = start = nl + 1;
+    }
+    client->buf_fill = end - start;
+    memmove(client->buf, start, client->buf_fill);
+}
+
+// Handles every complete frame in the buffer without copying it. A frame
+// that can't fit in the buffer gets an allocation of its own, and the
+// rest of it is received straight into that.
+void server_process_frames(struct server *server, struct client *client) {
+    char *start = client->buf;
+    char *end = client->buf + client->buf_fill;
+    while (start < end) {
+        size_t len;
+        int hdrlen = decode_varint(start, end - start, &len);
+        if (hdrlen == 0) break;
+        if (hdrlen < 0 || len > MAX_FRAME_SIZE) {
+            printf("bad frame, setting fd %d as dead\n", client->fd);
+            client->status = 0;
+            start = end;
+            break;
+        }
+        if (hdrlen + len > client->buf_size) {
+            size_t have = end - (start + hdrlen);
+            client->frame = client_alloc(server, client, len);
+            if (!client->frame) {
+                perror("client_alloc frame");
+                client->status = 0;
+            } else {
+                memcpy(client->frame, start + hdrlen, have);
+                client->frame_len = len;
+                client->frame_fill = have;
+            }
+            start = end;
+            break;
+        }
+        if (end - start < hdrlen + len) break;
+        server_handle_command(server, client, start + hdrlen, len);
+        start += hdrlen + len;
+    }
+    client->buf_fill = end - start;
+    memmove(client->buf, start, client->buf_fill);
+}
+
 void server_process_client(struct server *server, struct client *client, char *data, long datalen) {
     printf("server received %ld bytes\n", datalen);
-    for (unsigned i = 0; i < datalen; i++) {
-        if (data[i] == '\n') {
-            int oldcount = data - client->buf;
-            int cmdlen = oldcount + i;
-            char *cmd = strndup(client->buf, cmdlen);
-            // Process client command here.
-            printf("Full command received (%s)\n", cmd);
-            free(cmd);
-            // Shift any remaining data to the beginning of the buffer and start over
-            int remain = client->buf_fill - (cmdlen + 1);
-            memmove(client->buf, data + i + 1, remain);
-            client->buf_fill = remain;
-            data = client->buf;
-            datalen = client->buf_fill;
-            i = 0;
+    if (server->framing == FRAMING_BINARY) {
+        server_process_frames(server, client);
+    } else {
+        server_process_lines(server, client, data, datalen);
+    }
+}
+
+// Receives more of a large frame directly into its allocation
+void server_client_recv_frame(struct server *server, struct client *c) {
+    ssize_t recvd = recv(c->fd, c->frame + c->frame_fill, c->frame_len - c->frame_fill, 0);
+    if (recvd > 0) {
+        c->frame_fill += recvd;
+        if (c->frame_fill == c->frame_len) {
+            server_handle_command(server, c, c->frame, c->frame_len);
+            client_free(server, c, c->frame, c->frame_len);
+            c->frame = NULL;
         }
+    } else if (recvd == 0) {
+        c->status = 0;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recv frame");
+        c->status = 0;
     }
 }
 
 void server_client_recv(struct server *server, fd_set *readfds) {
-    int i;
+    int i = 0;
     struct list *clients = server->clients;
     while (clients) {
         struct client *c = clients->car;
-        if (FD_ISSET(c->fd, readfds)) {
-            char *dst = c->buf + c->buf_fill;
-            // TODO: expand the buffer if we fill it without receiving a newline
-            size_t recvd = recv(c->fd, dst, c->buf_size - c->buf_fill, 0);
-            if (recvd > 0) {
-                char *newdata = c->buf + c->buf_fill;
-                c->buf_fill += recvd;
-                server_process_client(server, c, newdata, recvd);
-            } else if (recvd == 0) {
-                printf("  got %zu bytes, setting %d as dead\n", recvd, i);
-                c->status = 0;
-            } else if (errno) {
-                perror("recv");
-                FD_ZERO(readfds);
+        if (c->frame) {
+            if (FD_ISSET(c->fd, readfds)) {
+                server_client_recv_frame(server, c);
+            }
+        } else {
+            if (FD_ISSET(c->fd, readfds) && !c->buf) {
+                if (client_borrow_buf(server, c)) {
+                    perror("client_borrow_buf");
+                    c->status = 0;
+                }
+            } else if (FD_ISSET(c->fd, readfds) && c->buf_fill == c->buf_size) {
+                // Grow the buffer, a line hasn't fit in it yet
+                unsigned size = c->buf_size * 2;
+                if (size > MAX_BUF_SIZE || client_resize_buf(server, c, size)) {
+                    printf("  line too long, setting %d as dead\n", i);
+                    c->status = 0;
+                }
+            }
+            if (c->status && FD_ISSET(c->fd, readfds)) {
+                char *dst = c->buf + c->buf_fill;
+                ssize_t recvd = recv(c->fd, dst, c->buf_size - c->buf_fill, 0);
+                if (recvd > 0) {
+                    char *newdata = c->buf + c->buf_fill;
+                    c->buf_fill += recvd;
+                    server_process_client(server, c, newdata, recvd);
+                    client_return_buf(server, c);
+                } else if (recvd == 0) {
+                    printf("  got %zd bytes, setting %d as dead\n", recvd, i);
+                    c->status = 0;
+                } else if (errno) {
+                    perror("recv");
+                    FD_ZERO(readfds);
+                }
             }
         }
         clients = clients->next;
+        i++;
+    }
+}
+
+// Queues each client's batch of replies and sends as much of its queue as
+// the socket takes, one writev per client. Clients with freshly queued
+// output are tried straight away rather than on the next select.
+void server_client_send(struct server *server, fd_set *writefds) {
+    struct list *clients;
+    for (clients = server->clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        struct iovec iov[SEND_IOV_MAX];
+        int n = 0;
+        if (!c->status) continue;
+        client_flush_reply(server, c);
+        if (!c->out_count || !(c->out_fresh || FD_ISSET(c->fd, writefds))) continue;
+        c->out_fresh = 0;
+
+        for (unsigned k = 0; k < c->out_count && n < SEND_IOV_MAX; k++) {
+            struct message *msg = c->out[(c->out_head + k) % c->out_cap];
+            size_t off = k == 0 ? c->out_off : 0;
+            iov[n].iov_base = msg->data + off;
+            iov[n].iov_len = msg->len - off;
+            n++;
+        }
+        ssize_t sent = writev(c->fd, iov, n);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("writev");
+                c->status = 0;
+            }
+            continue;
+        }
+        c->out_bytes -= sent;
+        while (sent > 0) {
+            struct message *msg = c->out[c->out_head];
+            size_t left = msg->len - c->out_off;
+            if ((size_t) sent < left) {
+                c->out_off += sent;
+                break;
+            }
+            sent -= left;
+            c->out_off = 0;
+            c->out_head = (c->out_head + 1) % c->out_cap;
+            c->out_count--;
+            message_unref(server, msg);
+        }
     }
 }
 
+// Brings memory use back under the budget. First empties the buffer pool,
+// releases the buffers of idle clients and shrinks the rest to fit what
+// they hold, then marks the largest consumers dead so
+// server_remove_dead_clients frees them.
+void server_enforce_budget(struct server *server) {
+    struct list *clients;
+    size_t shed = 0;
+    if (server->mem_used <= server->mem_budget) return;
+
+    server_drain_pool(server);
+    for (clients = server->clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        unsigned size = 0;
+        if (c->buf_fill > 0) {
+            size = c->buf_fill < MIN_BUF_SIZE ? MIN_BUF_SIZE : c->buf_fill;
+        }
+        if (size < c->buf_size) {
+            client_resize_buf(server, c, size);
+        }
+    }
+
+    if (server->mem_used <= server->mem_budget) return;
+    // under budget again once this much is freed
+    size_t excess = server->mem_used - server->mem_budget;
+    while (shed < excess) {
+        struct client *largest = NULL;
+        size_t largest_mem = 0;
+        for (clients = server->clients; clients; clients = clients->next) {
+            struct client *c = clients->car;
+            size_t mem = c->status ? client_sole_mem(c) : 0;
+            if (mem > largest_mem) {
+                largest = c;
+                largest_mem = mem;
+            }
+        }
+        if (!largest) break;
+        printf("over memory budget, dropping fd %d using %zu bytes\n", largest->fd, largest_mem);
+        largest->status = 0;
+        shed += largest_mem;
+        // let go of its queue now, so messages it shared with the next
+        // candidate count as that client's alone
+        client_clear_queue(server, largest);
+    }
+}
+
+// Memory that removing the client would free: its own allocations, its
+// unsent replies and the queued messages no other client holds
+size_t client_sole_mem(struct client *c) {
+    size_t mem = c->mem;
+    if (c->reply) {
+        mem += sizeof(struct message) + c->reply_cap;
+    }
+    for (unsigned k = 0; k < c->out_count; k++) {
+        struct message *msg = c->out[(c->out_head + k) % c->out_cap];
+        if (msg->refs == 1) {
+            mem += sizeof(struct message) + msg->len;
+        }
+    }
+    return mem;
+}
+
 int server_remove_dead_clients(struct server *server) {
     int num_removed = 0;
     int i = 0;
@@ -205,6 +1092,13 @@ int server_remove_dead_clients(struct server *server) {
             printf("remove client %d\n", i);
             close(tmpclient->fd);
             *holder = cell->next;
+            server_unsubscribe(server, tmpclient, NULL);
+            client_clear_queue(server, tmpclient);
+            if (tmpclient->frame) {
+                client_free(server, tmpclient, tmpclient->frame, tmpclient->frame_len);
+            }
+            client_resize_buf(server, tmpclient, 0);
+            server->mem_used -= tmpclient->mem;
             free(tmpclient);
             free(cell);
             num_removed++;
@@ -216,10 +1110,12 @@ int server_remove_dead_clients(struct server *server) {
     return num_removed;
 }
 
-struct client *make_client() {
+struct client *make_client(struct server *server) {
     struct client *c = calloc(1, sizeof(struct client));
-    c->buf_size = BUFSIZ;
-    c->buf = calloc(1, c->buf_size);
+    // the client and its list cell are charged to the client too
+    c->mem = sizeof(struct client) + sizeof(struct list);
+    server->mem_used += c->mem;
+    // no receive buffer until there's something to read
     return c;
 }
 
@@ -231,15 +1127,28 @@ void server_accept(struct server *server, fd_set *readfds) {
     struct client *tmpclient;
     int clientsock;
     if (FD_ISSET(server->fd, readfds)) {
-        tmpclient = make_client();
+        tmpclient = make_client(server);
         clientsock = accept_connection(server->fd, tmpclient);
         if (clientsock < 0) {
+            client_resize_buf(server, tmpclient, 0);
+            server->mem_used -= tmpclient->mem;
             free(tmpclient);
             perror("accept_connection");
             FD_ZERO(readfds);
         } else {
             printf("accepted\n");
             tmpclient->fd = clientsock;
+            // output is sent as the socket takes it, never blocking the loop
+            fcntl(clientsock, F_SETFL, fcntl(clientsock, F_GETFL) | O_NONBLOCK);
+#ifdef SO_BUSY_POLL
+            // let the kernel poll the device queue for us too
+            if (server->busy_poll_usec && setsockopt(clientsock, SOL_SOCKET, SO_BUSY_POLL,
+                                                     &server->busy_poll_usec, sizeof(server->busy_poll_usec))) {
+                // it won't work for the next one either
+                perror("setsockopt BUSY_POLL, not trying again");
+                server->busy_poll_usec = 0;
+            }
+#endif
             add_client_to_list(&server->clients, tmpclient);
             // server_greet(server, clientsock);
         }
@@ -248,7 +1157,7 @@ void server_accept(struct server *server, fd_set *readfds) {
 
 int accept_connection(int servsock, struct client *c) {
     int fd = 0;
-    socklen_t socklen;
+    socklen_t socklen = sizeof(c->sockaddr);
     fd = accept(servsock, (struct sockaddr *) &c->sockaddr, &socklen);
     if (fd > 0) {
         char address[INET_ADDRSTRLEN];
@@ -279,8 +1188,46 @@ ssize_t recv_all(int fd, void *buf, size_t num_bytes, int flags) {
 int main(int argc, char **argv) {
     struct server s = {0};
     char *port = "19567";
-    if (argc > 1) {
-        port = argv[1];
+    char *cpus = NULL;
+    int opt;
+    s.mem_budget = DEFAULT_MEM_BUDGET;
+    s.cpu = -1;
+    while ((opt = getopt(argc, argv, "m:f:c:l:k:")) != -1) {
+        switch (opt) {
+        case 'm':
+            s.mem_budget = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            s.framing = strcmp(optarg, "binary") ? FRAMING_TEXT : FRAMING_BINARY;
+            break;
+        case 'c':
+            cpus = optarg;
+            break;
+        case 'l':
+            s.spin_budget_usec = strtol(optarg, NULL, 10);
+            // start out spinning until we've seen how busy it is
+            s.spin_usec = s.spin_budget_usec;
+            s.event_gap_usec = s.spin_budget_usec / 2;
+            break;
+        case 'k':
+            s.busy_poll_usec = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m mem_budget_bytes] [-f text|binary] [-c cpu[,cpu...]] [-l spin_usec]\n"
+                    "    [-k busy_poll_usec] [port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        port = argv[optind];
+    }
+    // a client closing with output queued must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (cpus) {
+        if (setup_affinity(&s, cpus)) {
+            return 1;
+        }
+        server_prefill_pool(&s);
     }
     setup_server(&s, port);
     do {
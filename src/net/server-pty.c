@@ -6,22 +6,81 @@
 // The objective was to be able to run a curses program over a telnet
 // connection. See the notes file "curses-over-telnet".
 //
+// Output to the client is deflated (telnet COMPRESS2, as MUD clients do
+// MCCP) if the client agrees to it. There's no preset dictionary to share
+// between sessions: COMPRESS2 clients inflate a plain zlib stream and the
+// protocol has no way to hand them one.
+//
+// Each session's child can be limited (rlimits, nice, io priority and a
+// cgroup v2 group of its own) so a runaway session can't starve the
+// relay loop. Type "ps" in the console to see what each session uses.
+//
 // Work in progress
 //
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <pty.h>
+#else
 #include <util.h>
+#endif
 #include "util/list.h"
 
 #define MAX_CLIENTS 128
 
+#define IAC 255
+#define DONT 254
+#define DO 253
+#define WILL 251
+#define SB 250
+#define SE 240
+#define TELOPT_COMPRESS2 86
+// most bytes of an IAC DO/DONT COMPRESS2 answer that can end a recv
+#define TELNET_HELD_MAX 2
+
+#define DEFAULT_COMPRESS_LEVEL 6
+// percent of the time we're willing to spend compressing
+#define DEFAULT_COMPRESS_BUDGET 25
+// how often the time spent compressing is checked against the budget
+#define COMPRESS_WINDOW_USEC 1000000
+// windows compression stays off after the budget turns it off, doubled
+// each time it trips again soon after coming back, up to the max
+#define MIN_COMPRESS_HOLDOFF 2
+#define MAX_COMPRESS_HOLDOFF 64
+// how often each session's cpu and memory use is sampled
+#define ACCOUNT_INTERVAL_USEC 5000000
+
+// Limits applied to every session's child. Zero/NULL means no limit.
+struct session_limits {
+    // RLIMIT_CPU, in seconds
+    long cpu_seconds;
+    // memory.max in the session's cgroup, or RLIMIT_AS without one
+    long mem_bytes;
+    // RLIMIT_NPROC, which counts all of the server user's processes
+    long nproc;
+    int nice;
+    // io priority class, 1 realtime, 2 best effort, 3 idle (Linux only)
+    int io_class;
+    // cgroup v2 directory each session gets a sub-group in
+    char *cgroup;
+    // cpu.max for each session's group, e.g. "50000 100000" for half a CPU
+    char *cpu_max;
+};
+
 struct client {
     int fd;
     int status;
@@ -32,6 +91,25 @@ struct client {
     char *buf;
     unsigned buf_size;
     unsigned buf_fill;
+    // set once the client agrees to COMPRESS2, everything sent after that
+    // goes through zs
+    int compressing;
+    z_stream zs;
+    // whether we've sent IAC WILL COMPRESS2, and whether the client said DO.
+    // A client that said DO gets a new stream when compression comes back
+    // on after being too busy for it.
+    int compress_offered;
+    int compress_wanted;
+    // start of an answer to our offer, waiting for the rest
+    unsigned char telnet_held[TELNET_HELD_MAX];
+    int telnet_held_len;
+    // the child's cgroup, NULL if it doesn't have one
+    char *cgroup;
+    // last sample of the child's cpu time and memory, and the cpu time
+    // since the sample before
+    long cpu_usec;
+    long cpu_delta_usec;
+    long mem_bytes;
 };
 
 struct server {
@@ -40,6 +118,27 @@ struct server {
     int fd;
     // sockets for connected clients
     struct list *clients;
+    // SIGCHLD writes a byte to [1] so select wakes up on [0]
+    int child_pipe[2];
+
+    // level compression runs at, 0 when it's off because we're too busy
+    int compress_level;
+    // level asked for on the command line, 0 to never offer compression
+    int compress_max_level;
+    // percent of the time we're willing to spend compressing
+    int compress_budget;
+    // time spent compressing since the window started
+    long compress_usec;
+    long compress_window_start;
+    // windows left before compression may come back on, and how many to
+    // wait the next time it's turned off
+    int compress_off_windows;
+    int compress_holdoff;
+
+    struct session_limits limits;
+    long last_account;
+    // session cgroups that still had processes in them when removed
+    struct list *stale_cgroups;
 
     // buffer
     char msg[BUFSIZ];
@@ -50,9 +149,18 @@ struct server {
 void setup_server(struct server *server, char *port);
 void server_process_fds(struct server *server, int do_stdin);
 
-int setup_select(fd_set *fdset, int servsock, struct list *clients);
+int setup_select(fd_set *fdset, int servsock, int childfd, struct list *clients);
+long now_usec();
+void setup_child_pipe(struct server *server);
+int setup_session_cgroups(struct server *server);
 void server_console(struct server *server, fd_set *readfds);
+void server_print_sessions(struct server *server);
+void server_reap_children(struct server *server, fd_set *readfds);
 void server_client_recv(struct server *server, fd_set *readfds);
+ssize_t client_relay_output(struct server *server, struct client *c);
+void server_adapt_compression(struct server *server);
+void server_account_sessions(struct server *server);
+void client_remove_cgroup(struct server *server, struct client *c);
 int server_remove_dead_clients(struct server *server);
 void server_accept(struct server *server, fd_set *readfds);
 int accept_connection(int servsock, struct client *c);
@@ -109,28 +217,32 @@ void server_process_fds(struct server *server, int do_stdin) {
     int ready;
     struct timeval tv = {0};
 
-    int maxfd = setup_select(&readfds, server->fd, server->clients);
+    int maxfd = setup_select(&readfds, server->fd, server->child_pipe[0], server->clients);
     tv.tv_sec = 0;
     tv.tv_usec = 50000;
     ready = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+    server_account_sessions(server);
     if (ready > 0) {
         if (do_stdin) {
             server_console(server, &readfds);
         }
+        server_reap_children(server, &readfds);
         server_client_recv(server, &readfds);
+        server_adapt_compression(server);
         server_remove_dead_clients(server);
         server_accept(server, &readfds);
-    } else if (ready < 0) {
+    } else if (ready < 0 && errno != EINTR) {
         perror("server_process_fds select");
     }
 }
 
-int setup_select(fd_set *fdset, int servsock, struct list *clients) {
-    int maxfd = servsock;
+int setup_select(fd_set *fdset, int servsock, int childfd, struct list *clients) {
+    int maxfd = servsock > childfd ? servsock : childfd;
     int i;
 
     FD_ZERO(fdset);
     FD_SET(servsock, fdset);
+    FD_SET(childfd, fdset);
     FD_SET(STDIN_FILENO, fdset);
     while (clients) {
         struct client *c = clients->car;
@@ -149,6 +261,72 @@ int setup_select(fd_set *fdset, int servsock, struct list *clients) {
     return maxfd;
 }
 
+int child_pipe_write = -1;
+
+void on_sigchld(int sig) {
+    int saved = errno;
+    char c = 0;
+    write(child_pipe_write, &c, 1);
+    errno = saved;
+}
+
+// Sets up the self-pipe that turns SIGCHLD into something select sees
+void setup_child_pipe(struct server *server) {
+    struct sigaction sa = {0};
+    if (pipe(server->child_pipe)) {
+        perror("setup_child_pipe pipe");
+        server->running = 0;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(server->child_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(server->child_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    child_pipe_write = server->child_pipe[1];
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL)) {
+        perror("setup_child_pipe sigaction");
+        server->running = 0;
+    }
+}
+
+// Reaps every child that has exited, logging its status and resource
+// usage. Its client gets whatever output the child left on the pty, then
+// is marked dead so it's torn down right away.
+void server_reap_children(struct server *server, fd_set *readfds) {
+    char drain[64];
+    pid_t pid;
+    int status;
+    struct rusage rusage;
+    if (!FD_ISSET(server->child_pipe[0], readfds)) return;
+    while (read(server->child_pipe[0], drain, sizeof(drain)) > 0);
+
+    while ((pid = wait4(-1, &status, WNOHANG, &rusage)) > 0) {
+        struct list *clients;
+        struct client *c = NULL;
+        for (clients = server->clients; clients; clients = clients->next) {
+            struct client *tmp = clients->car;
+            if (tmp->pid == pid) {
+                c = tmp;
+                break;
+            }
+        }
+        printf("child %d (fd %d) %s %d, user %ld.%06lds sys %ld.%06lds maxrss %ld\n", pid,
+               c ? c->fd : -1, WIFSIGNALED(status) ? "killed by signal" : "exited with",
+               WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status),
+               (long) rusage.ru_utime.tv_sec, (long) rusage.ru_utime.tv_usec,
+               (long) rusage.ru_stime.tv_sec, (long) rusage.ru_stime.tv_usec,
+               rusage.ru_maxrss);
+        if (c) {
+            c->pid = 0;
+            while (client_relay_output(server, c) > 0);
+            c->status = 0;
+        }
+    }
+}
+
 void kill_children(struct server *server) {
     struct list *clients = server->clients;
     while (clients) {
@@ -172,12 +350,24 @@ void server_console(struct server *server, fd_set *readfds) {
         } else if (bytes_read < 0 && errno) {
             perror("server_console read");
             FD_ZERO(readfds);
+        } else if (bytes_read >= 2 && !strncmp(server->msg, "ps", 2)) {
+            server_print_sessions(server);
         } else {
             // server->msg now contains input from the console
         }
     }
 }
 
+void server_print_sessions(struct server *server) {
+    struct list *clients;
+    printf("%8s %6s %10s %6s %10s\n", "pid", "fd", "cpu s", "cpu %", "mem KiB");
+    for (clients = server->clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        printf("%8d %6d %10.2f %6ld %10ld\n", c->pid, c->fd, c->cpu_usec / 1e6,
+               c->cpu_delta_usec * 100 / ACCOUNT_INTERVAL_USEC, c->mem_bytes / 1024);
+    }
+}
+
 void server_process_client(struct server *server, struct client *client, char *data, long datalen) {
     printf("server received %ld bytes\n", datalen);
     for (unsigned i = 0; i < datalen; i++) {
@@ -199,21 +389,206 @@ void server_process_client(struct server *server, struct client *client, char *d
     }
 }
 
+long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Sends whatever deflate produces, counting the time deflate takes
+void client_deflate(struct server *server, struct client *c, char *data, size_t len, int flush) {
+    char out[BUFSIZ];
+    c->zs.next_in = (Bytef *) data;
+    c->zs.avail_in = len;
+    do {
+        c->zs.next_out = (Bytef *) out;
+        c->zs.avail_out = sizeof(out);
+        // only deflate counts, a slow link blocking send isn't our CPU
+        long start = now_usec();
+        deflate(&c->zs, flush);
+        server->compress_usec += now_usec() - start;
+        send(c->fd, out, sizeof(out) - c->zs.avail_out, 0);
+    } while (c->zs.avail_out == 0);
+}
+
+void client_offer_compress(struct server *server, struct client *c) {
+    unsigned char offer[] = { IAC, WILL, TELOPT_COMPRESS2 };
+    send(c->fd, offer, sizeof(offer), 0);
+    c->compress_offered = 1;
+}
+
+void client_start_compress(struct server *server, struct client *c) {
+    unsigned char start[] = { IAC, SB, TELOPT_COMPRESS2, IAC, SE };
+    if (c->compressing || !server->compress_level) return;
+    if (deflateInit(&c->zs, server->compress_level) != Z_OK) {
+        printf("deflateInit failed for fd %d\n", c->fd);
+        return;
+    }
+    // the client expects compressed data from the byte after SE on
+    send(c->fd, start, sizeof(start), 0);
+    c->compressing = 1;
+    printf("fd %d compressing at level %d\n", c->fd, server->compress_level);
+}
+
+// Finishing the stream tells the client to go back to uncompressed
+void client_end_compress(struct server *server, struct client *c) {
+    if (!c->compressing) return;
+    client_deflate(server, c, NULL, 0, Z_FINISH);
+    deflateEnd(&c->zs);
+    c->compressing = 0;
+}
+
+void client_set_compress_level(struct server *server, struct client *c, int level) {
+    char out[BUFSIZ];
+    if (!c->compressing) return;
+    // deflateParams may flush what's pending at the old level
+    c->zs.next_in = NULL;
+    c->zs.avail_in = 0;
+    c->zs.next_out = (Bytef *) out;
+    c->zs.avail_out = sizeof(out);
+    long start = now_usec();
+    deflateParams(&c->zs, level, Z_DEFAULT_STRATEGY);
+    server->compress_usec += now_usec() - start;
+    send(c->fd, out, sizeof(out) - c->zs.avail_out, 0);
+}
+
+void client_send_output(struct server *server, struct client *c, char *data, size_t len) {
+    if (c->compressing) {
+        client_deflate(server, c, data, len, Z_SYNC_FLUSH);
+    } else {
+        send(c->fd, data, len, 0);
+    }
+}
+
+// Takes the client's answers to our COMPRESS2 offer out of its input. buf
+// holds TELNET_HELD_MAX free bytes followed by the len bytes received. An
+// answer cut off at the end is held back until the next recv. Puts what's
+// left for the pty at the start of buf and returns its length.
+size_t client_telnet_input(struct server *server, struct client *c, char *buf, size_t len) {
+    unsigned char *out = (unsigned char *) buf;
+    unsigned char *in = out + TELNET_HELD_MAX - c->telnet_held_len;
+    size_t kept = 0;
+    memcpy(in, c->telnet_held, c->telnet_held_len);
+    len += c->telnet_held_len;
+    c->telnet_held_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == IAC && i + 2 >= len && (i + 1 == len || in[i + 1] == DO || in[i + 1] == DONT)) {
+            c->telnet_held_len = len - i;
+            memcpy(c->telnet_held, in + i, len - i);
+            break;
+        }
+        if (in[i] == IAC && i + 2 < len && (in[i + 1] == DO || in[i + 1] == DONT)
+            && in[i + 2] == TELOPT_COMPRESS2) {
+            c->compress_wanted = in[i + 1] == DO;
+            if (c->compress_wanted) {
+                client_start_compress(server, c);
+            } else {
+                client_end_compress(server, c);
+            }
+            i += 2;
+        } else {
+            out[kept++] = in[i];
+        }
+    }
+    return kept;
+}
+
+// Once per window, checks how much of the time went to compressing. Over
+// the budget, every stream drops a level, and when the level reaches 0
+// the streams are finished. Well under it, the level comes back up
+// towards the maximum, restarting streams for clients that wanted one and
+// offering compression to clients that connected while it was off.
+//
+// Nothing is compressed while it's off, so being under budget says
+// nothing about the load then. It stays off for compress_holdoff windows,
+// which doubles each time it has to be turned off again, and only resets
+// once a window with compression on is well under budget.
+void server_adapt_compression(struct server *server) {
+    long now = now_usec();
+    long elapsed = now - server->compress_window_start;
+    int level = server->compress_level;
+    struct list *clients;
+    if (!server->compress_max_level || elapsed < COMPRESS_WINDOW_USEC) return;
+
+    long share = server->compress_usec * 100 / elapsed;
+    if (level == 0 && server->compress_off_windows > 0) {
+        server->compress_off_windows--;
+    } else if (share > server->compress_budget && level > 0) {
+        level--;
+        if (level == 0) {
+            server->compress_off_windows = server->compress_holdoff;
+            if (server->compress_holdoff < MAX_COMPRESS_HOLDOFF) {
+                server->compress_holdoff *= 2;
+            }
+        }
+    } else if (share < server->compress_budget / 4) {
+        if (level > 0) {
+            server->compress_holdoff = MIN_COMPRESS_HOLDOFF;
+        }
+        if (level < server->compress_max_level) {
+            level++;
+        }
+    }
+    server->compress_usec = 0;
+    server->compress_window_start = now;
+    if (level == server->compress_level) return;
+
+    printf("compressing %ld%% of the time, level %d -> %d\n", share, server->compress_level, level);
+    server->compress_level = level;
+    for (clients = server->clients; clients; clients = clients->next) {
+        struct client *c = clients->car;
+        if (level == 0) {
+            client_end_compress(server, c);
+        } else if (c->compressing) {
+            client_set_compress_level(server, c, level);
+        } else if (c->compress_wanted) {
+            client_start_compress(server, c);
+        } else if (!c->compress_offered) {
+            client_offer_compress(server, c);
+        }
+    }
+}
+
+// Coalesces everything the child has written so far into one send, so
+// it's compressed and flushed once. Returns the number of bytes relayed,
+// 0 once the child's side of the pty is closed, or -1 if there's nothing
+// to read right now.
+ssize_t client_relay_output(struct server *server, struct client *c) {
+    size_t fill = 0;
+    ssize_t nread = 0;
+    while (fill < c->buf_size && (nread = read(c->master, c->buf + fill, c->buf_size - fill)) > 0) {
+        fill += nread;
+    }
+    if (fill > 0) {
+        client_send_output(server, c, c->buf, fill);
+        return fill;
+    }
+    if (nread == 0 || errno == EIO) {
+        return 0;
+    }
+    if (errno != EAGAIN) {
+        perror("read");
+    }
+    return -1;
+}
+
 void server_client_recv(struct server *server, fd_set *readfds) {
-    int i;
+    int i = 0;
     struct list *clients = server->clients;
     while (clients) {
         struct client *c = clients->car;
         if (FD_ISSET(c->fd, readfds)) {
+            // room in front for the start of a telnet answer from the last recv
             char *dst = c->buf + c->buf_fill;
-            size_t recvd = recv(c->fd, dst, c->buf_size - c->buf_fill, 0);
+            ssize_t recvd = recv(c->fd, dst + TELNET_HELD_MAX, c->buf_size - c->buf_fill - TELNET_HELD_MAX, 0);
             if (recvd > 0) {
-                printf("%d received %lu (", i, recvd);
-                fwrite(dst, recvd, 1, stdout);
+                printf("%d received %zd (", i, recvd);
+                fwrite(dst + TELNET_HELD_MAX, recvd, 1, stdout);
                 printf(")\n");
+                recvd = client_telnet_input(server, c, dst, recvd);
                 size_t written = write(c->master, dst, recvd);
             } else if (recvd == 0) {
-                printf("  got %zu bytes, setting %d as dead\n", recvd, i);
+                printf("  got %zd bytes, setting %d as dead\n", recvd, i);
                 c->status = 0;
             } else if (errno) {
                 perror("recv");
@@ -221,19 +596,13 @@ void server_client_recv(struct server *server, fd_set *readfds) {
             }
         }
         if (c->status && FD_ISSET(c->master, readfds)) {
-            size_t nread = read(c->master, c->buf, c->buf_size);
-            if (nread > 0) {
-                // printf("%d read (%.*s)\n", i, (int) nread, c->buf);
-                size_t sent = send(c->fd, c->buf, nread, 0);
-            } else if (nread == 0) {
-                printf("  read %zu bytes, setting %d as dead\n", nread, i);
+            if (client_relay_output(server, c) == 0) {
+                printf("  pty closed, setting %d as dead\n", i);
                 c->status = 0;
-            } else if (errno) {
-                perror("read");
-                FD_ZERO(readfds);
             }
         }
         clients = clients->next;
+        i++;
     }
 }
 
@@ -251,6 +620,10 @@ int server_remove_dead_clients(struct server *server) {
                 kill(tmpclient->pid, SIGKILL);
             }
             printf("remove client %d\n", i);
+            if (tmpclient->compressing) {
+                deflateEnd(&tmpclient->zs);
+            }
+            client_remove_cgroup(server, tmpclient);
             close(tmpclient->fd);
             close(tmpclient->master);
             *holder = cell->next;
@@ -276,6 +649,177 @@ void add_client_to_list(struct list **list, struct client *client) {
     *list = cons(client, *list);
 }
 
+int write_file(char *dir, char *name, char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) return -1;
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written < 0 ? -1 : 0;
+}
+
+// Reads a small file into buf, NUL terminated. Returns -1 on failure.
+int read_file(char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t nread = read(fd, buf, size - 1);
+    close(fd);
+    if (nread < 0) return -1;
+    buf[nread] = '\0';
+    return 0;
+}
+
+// cpu.max and memory.max only show up in the session groups once the
+// controllers are enabled for the groups under the -g directory. That
+// needs the directory to be writable and to have no processes of its own.
+// Returns -1 if they can't be enabled.
+int setup_session_cgroups(struct server *server) {
+    if (!server->limits.cgroup) return 0;
+    if (write_file(server->limits.cgroup, "cgroup.subtree_control", "+cpu +memory")) {
+        perror("setup_session_cgroups cgroup.subtree_control +cpu +memory");
+        return -1;
+    }
+    return 0;
+}
+
+char *session_cgroup_path(struct server *server, pid_t pid) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/session-%d", server->limits.cgroup, pid);
+    return strdup(path);
+}
+
+// Runs in the child between fork and exec. Problems are reported on the
+// pty, so the user sees them.
+void apply_session_limits(struct server *server) {
+    struct session_limits *limits = &server->limits;
+    struct rlimit rl;
+    if (limits->cgroup) {
+        char pid[32];
+        char *path = session_cgroup_path(server, getpid());
+        snprintf(pid, sizeof(pid), "%d", getpid());
+        if (mkdir(path, 0755)) {
+            perror("session cgroup mkdir");
+        } else {
+            if (limits->cpu_max && write_file(path, "cpu.max", limits->cpu_max)) {
+                perror("session cgroup cpu.max");
+            }
+            if (limits->mem_bytes) {
+                char mem[32];
+                snprintf(mem, sizeof(mem), "%ld", limits->mem_bytes);
+                if (write_file(path, "memory.max", mem)) {
+                    perror("session cgroup memory.max");
+                }
+            }
+            if (write_file(path, "cgroup.procs", pid)) {
+                perror("session cgroup.procs");
+            }
+        }
+        free(path);
+    }
+    if (limits->cpu_seconds) {
+        rl.rlim_cur = rl.rlim_max = limits->cpu_seconds;
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    // Address space is usually many times what's resident, so with a
+    // cgroup its memory.max is the only limit
+    if (limits->mem_bytes && !limits->cgroup) {
+        rl.rlim_cur = rl.rlim_max = limits->mem_bytes;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (limits->nproc) {
+        rl.rlim_cur = rl.rlim_max = limits->nproc;
+        setrlimit(RLIMIT_NPROC, &rl);
+    }
+    if (limits->nice) {
+        setpriority(PRIO_PROCESS, 0, limits->nice);
+    }
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (limits->io_class) {
+        // IOPRIO_WHO_PROCESS, priority 4 within best effort
+        int ioprio = limits->io_class << 13 | (limits->io_class == 2 ? 4 : 0);
+        if (syscall(SYS_ioprio_set, 1, 0, ioprio)) {
+            perror("ioprio_set");
+        }
+    }
+#endif
+}
+
+// Samples the cpu time and memory of a session, from its cgroup if it has
+// one (which covers everything it started) or else from /proc
+void client_account(struct server *server, struct client *c) {
+    char buf[1024];
+    char path[PATH_MAX];
+    long cpu_usec = -1;
+    if (c->cgroup) {
+        snprintf(path, sizeof(path), "%s/cpu.stat", c->cgroup);
+        if (!read_file(path, buf, sizeof(buf))) {
+            sscanf(buf, "usage_usec %ld", &cpu_usec);
+        }
+        snprintf(path, sizeof(path), "%s/memory.current", c->cgroup);
+        if (!read_file(path, buf, sizeof(buf))) {
+            c->mem_bytes = atol(buf);
+        }
+    }
+#ifdef __linux__
+    if (cpu_usec < 0 && c->pid) {
+        snprintf(path, sizeof(path), "/proc/%d/stat", c->pid);
+        char *fields = read_file(path, buf, sizeof(buf)) ? NULL : strrchr(buf, ')');
+        unsigned long utime;
+        unsigned long stime;
+        long rss;
+        // utime, stime and rss, proc(5) fields 14, 15 and 24; the scan
+        // starts at field 3, the state after the command name
+        if (fields && sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                             "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime, &rss) == 3) {
+            long ticks = sysconf(_SC_CLK_TCK);
+            cpu_usec = (utime + stime) * (1000000 / ticks);
+            c->mem_bytes = rss * sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    if (cpu_usec >= 0) {
+        c->cpu_delta_usec = cpu_usec - c->cpu_usec;
+        c->cpu_usec = cpu_usec;
+    }
+}
+
+// Every ACCOUNT_INTERVAL_USEC, samples every session and retries removing
+// cgroups that weren't empty yet
+void server_account_sessions(struct server *server) {
+    long now = now_usec();
+    struct list *clients;
+    if (now - server->last_account < ACCOUNT_INTERVAL_USEC) return;
+    server->last_account = now;
+    for (clients = server->clients; clients; clients = clients->next) {
+        client_account(server, clients->car);
+    }
+    struct list **holder = &server->stale_cgroups;
+    while (*holder) {
+        struct list *cell = *holder;
+        if (!rmdir(cell->car) || errno == ENOENT) {
+            *holder = cell->next;
+            free(cell->car);
+            free(cell);
+        } else {
+            holder = &cell->next;
+        }
+    }
+}
+
+// Kills whatever is left in the session's cgroup and removes it, or
+// leaves it for server_account_sessions if it can't go yet
+void client_remove_cgroup(struct server *server, struct client *c) {
+    if (!c->cgroup) return;
+    write_file(c->cgroup, "cgroup.kill", "1");
+    if (rmdir(c->cgroup) && errno != ENOENT) {
+        server->stale_cgroups = cons(c->cgroup, server->stale_cgroups);
+    } else {
+        free(c->cgroup);
+    }
+    c->cgroup = NULL;
+}
+
 void fork_client(struct server *server, struct client *client) {
     int stat = openpty(&client->master, &client->slave, NULL, NULL, NULL);
     client->pid = fork();
@@ -292,10 +836,16 @@ void fork_client(struct server *server, struct client *client) {
 
         close(client->master);
         close(server->fd);
+        apply_session_limits(server);
         // execlp("./ech", "ech", 0);
         execlp("top", "top", 0);
+        _exit(127);
     } else {
         close(client->slave);
+        fcntl(client->master, F_SETFL, fcntl(client->master, F_GETFL) | O_NONBLOCK);
+        if (server->limits.cgroup) {
+            client->cgroup = session_cgroup_path(server, client->pid);
+        }
         printf("child created %d\n", client->pid);
     }
 }
@@ -315,6 +865,9 @@ void server_accept(struct server *server, fd_set *readfds) {
             client->fd = clientsock;
             add_client_to_list(&server->clients, client);
             fork_client(server, client);
+            if (server->compress_level) {
+                client_offer_compress(server, client);
+            }
             // server_greet(server, clientsock);
         }
     }
@@ -322,7 +875,7 @@ void server_accept(struct server *server, fd_set *readfds) {
 
 int accept_connection(int servsock, struct client *c) {
     int fd = 0;
-    socklen_t socklen;
+    socklen_t socklen = sizeof(c->sockaddr);
     fd = accept(servsock, (struct sockaddr *) &c->sockaddr, &socklen);
     if (fd > 0) {
         char address[INET_ADDRSTRLEN];
@@ -353,10 +906,58 @@ ssize_t recv_all(int fd, void *buf, size_t num_bytes, int flags) {
 int main(int argc, char **argv) {
     struct server s = {0};
     char *port = "19567";
-    if (argc > 1) {
-        port = argv[1];
+    int opt;
+    s.compress_max_level = DEFAULT_COMPRESS_LEVEL;
+    s.compress_budget = DEFAULT_COMPRESS_BUDGET;
+    while ((opt = getopt(argc, argv, "z:b:t:m:p:n:i:g:c:")) != -1) {
+        switch (opt) {
+        case 'z':
+            s.compress_max_level = atoi(optarg);
+            break;
+        case 'b':
+            s.compress_budget = atoi(optarg);
+            break;
+        case 't':
+            s.limits.cpu_seconds = atol(optarg);
+            break;
+        case 'm':
+            s.limits.mem_bytes = atol(optarg);
+            break;
+        case 'p':
+            s.limits.nproc = atol(optarg);
+            break;
+        case 'n':
+            s.limits.nice = atoi(optarg);
+            break;
+        case 'i':
+            s.limits.io_class = atoi(optarg);
+            break;
+        case 'g':
+            s.limits.cgroup = optarg;
+            break;
+        case 'c':
+            s.limits.cpu_max = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-z compress_level] [-b compress_cpu_percent]\n"
+                    "    [-t cpu_seconds] [-m mem_bytes] [-p nproc] [-n nice] [-i io_class]\n"
+                    "    [-g cgroup_dir [-c cpu_max]] [port]\n"
+                    "cgroup_dir is a cgroup v2 directory we can write, with no processes\n"
+                    "in it, where the cpu and memory controllers can be enabled.\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        port = argv[optind];
+    }
+    if (setup_session_cgroups(&s)) {
+        return 1;
     }
+    s.compress_level = s.compress_max_level;
+    s.compress_window_start = now_usec();
+    s.compress_holdoff = MIN_COMPRESS_HOLDOFF;
     setup_server(&s, port);
+    setup_child_pipe(&s);
     do {
         server_process_fds(&s, 1);
     } while (s.running);
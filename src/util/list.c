@@ -3,7 +3,9 @@
 
 struct list *cons(void *car, void *cdr) {
     struct list *l = malloc(sizeof(struct list));
-    l->car = car;
-    l->cdr = cdr;
+    if (l) {
+        l->car = car;
+        l->cdr = cdr;
+    }
     return l;
 }
@@ -8,4 +8,5 @@ struct list {
     };
 };
 
+// Returns NULL if out of memory
 struct list *cons(void *car, void *cdr);